@@ -11,6 +11,11 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/inotify.h>
+#include <poll.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <limits.h>
 #include <unistd.h>
 
@@ -21,6 +26,16 @@
 #endif
 #define MAX_CHILDREN 128
 
+#define TEMP_PREFIX ".bms-tmp."
+#define GROUP_COMMIT_FILES 256
+#define GROUP_COMMIT_BYTES (64L * 1024 * 1024)
+#define GROUP_COMMIT_INTERVAL_MS 1000
+
+#define REMOTE_MAGIC "bms1"
+#define RECORD_HEADER 25
+#define FRAME_SIZE (256 * 1024)
+#define RECONNECT_DELAY 1
+
 typedef struct {
     pid_t pid;
     char target[PATH_MAX];
@@ -44,12 +59,52 @@ typedef struct {
     int active;
 } Backup;
 
+typedef enum {
+    DUR_NONE,
+    DUR_ATOMIC,
+    DUR_GROUP
+} durability_mode;
+
+struct PendingFile {
+    char tmp[PATH_MAX];
+    char target[PATH_MAX];
+};
+
+// durability state of the current process, every backup child gets its own copy after fork
+struct Durability {
+    durability_mode mode;
+    int root_fd;
+    struct PendingFile pending[GROUP_COMMIT_FILES];
+    int pending_count;
+    int pending_ops;
+    off_t pending_bytes;
+    struct timespec first_pending;
+    long files;
+    long long bytes;
+};
+
+struct Durability dur = {.mode = DUR_NONE, .root_fd = -1};
+
 void add_to_map(struct WatchMap *map, int wd, const char *path) {
     map->watch_map[map->watch_count].wd = wd;
     map->watch_map[map->watch_count].path = strdup(path);
     map->watch_count++;
 }
 
+// moves the watches of old_path and everything below it over to new_path
+void rename_watches(struct WatchMap *map, const char *old_path, const char *new_path) {
+    size_t old_len = strlen(old_path);
+    char path[PATH_MAX];
+    for (int i = 0; i < map->watch_count; i++) {
+        char *p = map->watch_map[i].path;
+        if (strncmp(p, old_path, old_len) != 0 || (p[old_len] != '\0' && p[old_len] != '/'))
+            continue;
+        snprintf(path, sizeof(path), "%s%s", new_path, p + old_len);
+        free(p);
+        map->watch_map[i].path = strdup(path);
+    }
+}
+
 struct Watch *find_watch(struct WatchMap *map, int wd) {
     for (int i = 0; i < map->watch_count; i++)
         if (map->watch_map[i].wd == wd)
@@ -60,7 +115,7 @@ struct Watch *find_watch(struct WatchMap *map, int wd) {
 void add_watch_recursive(int fd, struct WatchMap *map, const char *base_path) {
     uint32_t mask = IN_CREATE | IN_MODIFY | IN_DELETE |
                     IN_MOVED_FROM | IN_MOVED_TO |
-                    IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED;
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_ATTRIB;
 
     int wd = inotify_add_watch(fd, base_path, mask);
     if (wd < 0)
@@ -115,6 +170,12 @@ void usage(int argc, char* argv[])
     exit(EXIT_FAILURE);
 }
 
+// 1 if path is root itself or somewhere below it
+int is_inside(const char *root, const char *path) {
+    size_t len = strlen(root);
+    return strncmp(root, path, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
 int isDirectoryEmpty(char *dirname) {
   int n = 0;
   struct dirent *d;
@@ -133,25 +194,226 @@ int isDirectoryEmpty(char *dirname) {
     //https://stackoverflow.com/questions/6383584/check-if-a-directory-is-empty-using-c-on-linux
 }
 
+const char* durability_name(durability_mode mode){
+    if(mode == DUR_ATOMIC)
+        return "atomic";
+    if(mode == DUR_GROUP)
+        return "group";
+    return "none";
+}
+
+int parse_durability(const char* name, durability_mode* mode){
+    if(strcmp(name, "none") == 0)
+        *mode = DUR_NONE;
+    else if(strcmp(name, "atomic") == 0)
+        *mode = DUR_ATOMIC;
+    else if(strcmp(name, "group") == 0)
+        *mode = DUR_GROUP;
+    else
+        return -1;
+    return 0;
+}
+
+int is_temp_name(const char* name){
+    return strncmp(name, TEMP_PREFIX, strlen(TEMP_PREFIX)) == 0;
+}
+
+void sync_parent_dir(const char* path){
+    char dir[PATH_MAX];
+    strncpy(dir, path, PATH_MAX - 1);
+    dir[PATH_MAX - 1] = '\0';
+    char* slash = strrchr(dir, '/');
+    if(slash == NULL)
+        strcpy(dir, ".");
+    else if(slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(fd == -1)
+        ERR("open");
+    if(fsync(fd) == -1)
+        ERR("fsync");
+    close(fd);
+}
+
+// temp file lives next to the target so rename() stays on one filesystem
+int open_temp(const char* target, char* tmp){
+    const char* slash = strrchr(target, '/');
+    if(slash == NULL)
+        snprintf(tmp, PATH_MAX, TEMP_PREFIX "%.200s.XXXXXX", target);
+    else
+        snprintf(tmp, PATH_MAX, "%.*s/" TEMP_PREFIX "%.200s.XXXXXX", (int)(slash - target), target, slash + 1);
+
+    int fd = mkstemp(tmp);
+    if(fd == -1)
+        return -1;
+    mode_t mask = umask(0);
+    umask(mask);
+    if(fchmod(fd, 0666 & ~mask) == -1)
+        ERR("fchmod");
+    return fd;
+}
+
+long elapsed_ms(const struct timespec* since){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+int group_commit_pending(){
+    return dur.pending_count + dur.pending_ops;
+}
+
+// one syncfs for the file data of the whole batch, renames, then one more for the directory entries
+void group_commit_flush(){
+    if(group_commit_pending() == 0)
+        return;
+    if(syncfs(dur.root_fd) == -1)
+        ERR("syncfs");
+    if(dur.pending_count > 0){
+        for(int i = 0; i < dur.pending_count; i++){
+            if(rename(dur.pending[i].tmp, dur.pending[i].target) == -1)
+                ERR("rename");
+        }
+        if(syncfs(dur.root_fd) == -1)
+            ERR("syncfs");
+    }
+    dur.pending_count = 0;
+    dur.pending_ops = 0;
+    dur.pending_bytes = 0;
+}
+
+void group_commit_start(){
+    if(group_commit_pending() == 0)
+        clock_gettime(CLOCK_MONOTONIC, &dur.first_pending);
+}
+
+// time left until the oldest pending entry is due, events that commit nothing must not push it back
+int group_commit_timeout(){
+    long left = GROUP_COMMIT_INTERVAL_MS - elapsed_ms(&dur.first_pending);
+    return left > 0 ? (int)left : 0;
+}
+
+void group_commit_check(){
+    if(group_commit_pending() >= GROUP_COMMIT_FILES || dur.pending_bytes >= GROUP_COMMIT_BYTES ||
+       elapsed_ms(&dur.first_pending) >= GROUP_COMMIT_INTERVAL_MS)
+        group_commit_flush();
+}
+
+// drops pending files at path or below it, returns how many were dropped
+int group_commit_discard(const char* path){
+    size_t len = strlen(path);
+    int discarded = 0;
+    int i = 0;
+    while(i < dur.pending_count){
+        const char* t = dur.pending[i].target;
+        if(strncmp(t, path, len) == 0 && (t[len] == '\0' || t[len] == '/')){
+            unlink(dur.pending[i].tmp);
+            dur.pending[i] = dur.pending[--dur.pending_count];
+            discarded++;
+        }
+        else
+            i++;
+    }
+    return discarded;
+}
+
+void group_commit_add(const char* tmp, const char* target, off_t size){
+    group_commit_discard(target);
+    group_commit_start();
+    strcpy(dur.pending[dur.pending_count].tmp, tmp);
+    strcpy(dur.pending[dur.pending_count].target, target);
+    dur.pending_count++;
+    dur.pending_bytes += size;
+    group_commit_check();
+}
+
+// makes a new, removed or renamed directory entry durable, right away or with the next group commit
+void durable_entry(const char* path){
+    if(dur.mode == DUR_ATOMIC)
+        sync_parent_dir(path);
+    else if(dur.mode == DUR_GROUP){
+        group_commit_start();
+        dur.pending_ops++;
+        group_commit_check();
+    }
+}
+
+void durability_begin(const char* root){
+    dur.pending_count = 0;
+    dur.pending_ops = 0;
+    dur.pending_bytes = 0;
+    if(dur.mode == DUR_GROUP){
+        dur.root_fd = open(root, O_RDONLY | O_DIRECTORY);
+        if(dur.root_fd == -1)
+            ERR("open");
+    }
+}
+
+void durability_end(){
+    if(dur.mode == DUR_GROUP){
+        // sync even with nothing pending, mkdirs or unlinks from before the last flush may not be on disk yet
+        if(group_commit_pending() > 0)
+            group_commit_flush();
+        else if(syncfs(dur.root_fd) == -1)
+            ERR("syncfs");
+        close(dur.root_fd);
+        dur.root_fd = -1;
+    }
+}
+
+// opens the file that will become target, a temp file next to it unless durability is off, -1 on failure
+int open_target(const char* target, char* tmp){
+    if(dur.mode == DUR_NONE)
+        return open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    return open_temp(target, tmp);
+}
+
+// closes a file opened by open_target and makes it visible as target according to the durability mode
+void commit_target(int fd_target, const char* tmp, const char* target, off_t size){
+    if(dur.mode == DUR_ATOMIC && fsync(fd_target) == -1)
+        ERR("fsync");
+    // start writeback now so the group syncfs has less left to wait for
+    if(dur.mode == DUR_GROUP && sync_file_range(fd_target, 0, 0, SYNC_FILE_RANGE_WRITE) == -1)
+        ERR("sync_file_range");
+    close(fd_target);
+
+    if(dur.mode == DUR_ATOMIC){
+        if(rename(tmp, target) == -1)
+            ERR("rename");
+        sync_parent_dir(target);
+    }
+    else if(dur.mode == DUR_GROUP)
+        group_commit_add(tmp, target, size);
+
+    dur.files++;
+    dur.bytes += size;
+}
+
 void copy_file(const char* source, const char* target){
     int fd = open(source, O_RDONLY);
     if(fd == -1)
         {ERR("open");}
-    int fd_target = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    char tmp[PATH_MAX];
+    int fd_target = open_target(target, tmp);
     if(fd_target == -1)
         {ERR("open");}
     
     char buf[8192];
     ssize_t r;
+    off_t size = 0;
     while ((r = read(fd, buf, sizeof(buf))) > 0) {
         if (write(fd_target, buf, r) != r)
             ERR("write");
+        size += r;
     }
     if (r < 0) 
         ERR("read");
 
     close(fd);
-    close(fd_target);
+    commit_target(fd_target, tmp, target, size);
 }
 
 
@@ -174,12 +436,14 @@ void copy_symlink(const char *src, const char *dst, const char *src_root, const
 
             if (symlink(newlink, dst) < 0)
                 ERR("symlink rewrite");
+            durable_entry(dst);
             return;
         }
     }
 
     if (symlink(linkbuf, dst) < 0)
         ERR("symlink");
+    durable_entry(dst);
 }
 
 void copy_recursive(const char *src, const char *target, const char *src_root, const char *target_root) {
@@ -198,6 +462,7 @@ void copy_recursive(const char *src, const char *target, const char *src_root, c
     if(S_ISDIR(st.st_mode)){
         if(mkdir(target, 0777) == -1 && errno != EEXIST)
             ERR("mkdir");
+        durable_entry(target);
         
         DIR *dir = opendir(src);
         if(dir == NULL)
@@ -207,7 +472,7 @@ void copy_recursive(const char *src, const char *target, const char *src_root, c
         char src_path[PATH_MAX], target_path[PATH_MAX];
 
         while ((e = readdir(dir)) != NULL){
-            if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 || is_temp_name(e->d_name))
                 continue;
 
 
@@ -303,7 +568,7 @@ void restore_recursive(const char *src, const char* target, const char *src_root
         char src_path[PATH_MAX], target_path[PATH_MAX];
 
         while ((e = readdir(dir)) != NULL){
-            if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 || is_temp_name(e->d_name))
                 continue;
 
 
@@ -314,13 +579,15 @@ void restore_recursive(const char *src, const char* target, const char *src_root
             restore_recursive(src_path, target_path, src_root, target_root);
         }
         closedir(dir);
+        // files restored above may still sit in temp files waiting for their group commit
+        group_commit_flush();
 
         DIR *dir_src = opendir(src);
         if (!dir_src)
             ERR("opendir");
 
         while ((e = readdir(dir_src)) != NULL) {
-            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..") || is_temp_name(e->d_name))
                 continue;
 
             snprintf(src_path, sizeof(src_path), "%s/%s", src, e->d_name);
@@ -336,6 +603,814 @@ void restore_recursive(const char *src, const char* target, const char *src_root
     }
 }
 
+//          REMOTE TARGETS
+// every operation is one record: op(1) mode(4) mtime_ns(8) path_len(2) arg_len(2) size(8), then the path, the arg
+// and size bytes of file data. Paths are relative to the backup root. Records are packed into frames of up to
+// FRAME_SIZE bytes that go out in a single write, so small files travel many per frame and nothing waits for a reply.
+
+enum {
+    OP_HELLO = 1,
+    OP_MANIFEST,
+    OP_END,
+    OP_MKDIR,
+    OP_FILE,
+    OP_SYMLINK,
+    OP_DELETE,
+    OP_RENAME,
+    OP_META,
+    OP_BUSY
+};
+
+#define REMOTE_BUSY -2
+
+struct Record {
+    uint8_t op;
+    uint32_t mode;
+    uint64_t mtime;
+    uint64_t size;
+    char path[PATH_MAX];
+    char arg[PATH_MAX];
+};
+
+struct Writer {
+    int fd;
+    int broken;
+    size_t len;
+    char buf[FRAME_SIZE];
+};
+
+struct Reader {
+    int fd;
+    int listen_fd;
+    size_t pos;
+    size_t len;
+    char buf[65536];
+};
+
+struct ManifestEntry {
+    char *path;
+    mode_t mode;
+    uint64_t mtime;
+    uint64_t size;
+};
+
+// connection of a backup child to its receiver, fd is -1 for local targets
+struct Remote {
+    char addr[PATH_MAX];
+    char root[PATH_MAX];
+    struct Writer out;
+    struct ManifestEntry *manifest;
+    int manifest_count;
+};
+
+struct Remote remote = {.out = {.fd = -1}};
+
+int is_remote(const char *target) {
+    return strncmp(target, "unix:", 5) == 0 || strncmp(target, "tcp:", 4) == 0;
+}
+
+// opens a socket for "unix:<path>" or "tcp:<host>:<port>", listening on it or connected to it
+int remote_socket(const char *target, int listening) {
+    int fd;
+    if (strncmp(target, "unix:", 5) == 0) {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, target + 5, sizeof(sa.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1)
+            ERR("socket");
+        if (listening) {
+            // only a leftover socket nobody listens on is replaced, anything else at the path makes bind fail
+            struct stat st;
+            if (lstat(sa.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+                if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+                    close(fd);
+                    return -1;
+                }
+                unlink(sa.sun_path);
+            }
+            if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(fd, 8) == -1) {
+                close(fd);
+                return -1;
+            }
+        } else if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    char host[PATH_MAX];
+    strncpy(host, target + 4, PATH_MAX - 1);
+    host[PATH_MAX - 1] = '\0';
+    char *port = strrchr(host, ':');
+    if (port == NULL)
+        return -1;
+    *port++ = '\0';
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    // the stream is unauthenticated, so an empty host means loopback and not every interface
+    if (getaddrinfo(host[0] ? host : "localhost", port, &hints, &res) != 0)
+        return -1;
+
+    fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        int ok;
+        if (listening) {
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 8) == 0;
+        } else
+            ok = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        if (!ok) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// sends the current frame, a failed write marks the writer broken and the rest is dropped until reconnect
+void writer_flush(struct Writer *w) {
+    if (!w->broken && w->len > 0 && write_all(w->fd, w->buf, w->len) == -1)
+        w->broken = 1;
+    w->len = 0;
+}
+
+void writer_put(struct Writer *w, const void *data, size_t len) {
+    if (w->broken)
+        return;
+    if (w->len + len > FRAME_SIZE)
+        writer_flush(w);
+    if (len > FRAME_SIZE) {
+        if (!w->broken && write_all(w->fd, data, len) == -1)
+            w->broken = 1;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+void put_be(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+uint64_t get_be(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+void writer_record(struct Writer *w, uint8_t op, uint32_t mode, uint64_t mtime, uint64_t size, const char *path,
+                   const char *arg) {
+    unsigned char h[RECORD_HEADER];
+    size_t path_len = strlen(path);
+    size_t arg_len = arg ? strlen(arg) : 0;
+    h[0] = op;
+    put_be(h + 1, mode, 4);
+    put_be(h + 5, mtime, 8);
+    put_be(h + 13, path_len, 2);
+    put_be(h + 15, arg_len, 2);
+    put_be(h + 17, size, 8);
+    writer_put(w, h, sizeof(h));
+    writer_put(w, path, path_len);
+    if (arg_len > 0)
+        writer_put(w, arg, arg_len);
+}
+
+// a receiver root mirrors exactly one source, so other senders are turned away while one is connected
+void reject_sender(int listen_fd) {
+    static struct Writer w;
+    int conn = accept(listen_fd, NULL, NULL);
+    if (conn == -1)
+        return;
+    w.fd = conn;
+    w.broken = 0;
+    w.len = 0;
+    writer_record(&w, OP_BUSY, 0, 0, 0, "", NULL);
+    writer_flush(&w);
+    close(conn);
+}
+
+// returns -1 once the peer is gone or we were told to stop, a receiver keeps rejecting new senders meanwhile
+int reader_fill(struct Reader *r) {
+    while (1) {
+        if (last_signal == SIGINT || last_signal == SIGTERM)
+            return -1;
+        int pending = dur.mode == DUR_GROUP && group_commit_pending() > 0;
+        if (pending || r->listen_fd != -1) {
+            struct pollfd pfd[2] = {{.fd = r->fd, .events = POLLIN}, {.fd = r->listen_fd, .events = POLLIN}};
+            int ready = poll(pfd, 2, pending ? group_commit_timeout() : -1);
+            if (ready < 0) {
+                if (errno == EINTR)
+                    continue;
+                ERR("poll");
+            }
+            if (ready == 0) {
+                group_commit_flush();
+                continue;
+            }
+            if (pfd[1].revents & POLLIN)
+                reject_sender(r->listen_fd);
+            if (pfd[0].revents == 0)
+                continue;
+        }
+        ssize_t n = read(r->fd, r->buf, sizeof(r->buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        r->pos = 0;
+        r->len = n;
+        return 0;
+    }
+}
+
+int reader_get(struct Reader *r, void *dst, size_t len) {
+    char *d = dst;
+    while (len > 0) {
+        if (r->pos == r->len && reader_fill(r) == -1)
+            return -1;
+        size_t n = r->len - r->pos;
+        if (n > len)
+            n = len;
+        memcpy(d, r->buf + r->pos, n);
+        r->pos += n;
+        d += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// reads everything of a record except its file data
+int reader_record(struct Reader *r, struct Record *rec) {
+    unsigned char h[RECORD_HEADER];
+    if (reader_get(r, h, sizeof(h)) == -1)
+        return -1;
+    rec->op = h[0];
+    rec->mode = get_be(h + 1, 4);
+    rec->mtime = get_be(h + 5, 8);
+    rec->size = get_be(h + 17, 8);
+    size_t path_len = get_be(h + 13, 2);
+    size_t arg_len = get_be(h + 15, 2);
+    if (path_len >= PATH_MAX || arg_len >= PATH_MAX)
+        return -1;
+    if (reader_get(r, rec->path, path_len) == -1 || reader_get(r, rec->arg, arg_len) == -1)
+        return -1;
+    rec->path[path_len] = '\0';
+    rec->arg[arg_len] = '\0';
+    return 0;
+}
+
+uint64_t mtime_ns(const struct stat *st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+const char *rel_path(const char *path) {
+    return path + strlen(remote.root);
+}
+
+int manifest_cmp(const void *a, const void *b) {
+    return strcmp(((const struct ManifestEntry *)a)->path, ((const struct ManifestEntry *)b)->path);
+}
+
+struct ManifestEntry *manifest_find(const char *rel) {
+    if (remote.manifest_count == 0)
+        return NULL;
+    struct ManifestEntry key = {.path = (char *)rel};
+    return bsearch(&key, remote.manifest, remote.manifest_count, sizeof(key), manifest_cmp);
+}
+
+void manifest_free() {
+    for (int i = 0; i < remote.manifest_count; i++)
+        free(remote.manifest[i].path);
+    free(remote.manifest);
+    remote.manifest = NULL;
+    remote.manifest_count = 0;
+}
+
+void remote_send_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        // already gone again, its IN_DELETE is on the way
+        if (errno == ENOENT)
+            return;
+        ERR("open");
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        ERR("fstat");
+    writer_record(&remote.out, OP_FILE, st.st_mode & 07777, mtime_ns(&st), st.st_size, rel_path(path), NULL);
+
+    char buf[8192];
+    uint64_t left = st.st_size;
+    while (left > 0) {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+        ssize_t r = read(fd, buf, n);
+        if (r < 0)
+            ERR("read");
+        // file shrank while sending, pad it out and let the next IN_MODIFY send it again
+        if (r == 0)
+            memset(buf, 0, n);
+        else
+            n = r;
+        writer_put(&remote.out, buf, n);
+        left -= n;
+    }
+    close(fd);
+}
+
+// like copy_symlink, links into the source go relative to the root (mode 1) and the receiver puts its own root in front
+void remote_send_symlink(const char *path) {
+    char linkbuf[PATH_MAX], link_real[PATH_MAX];
+    ssize_t len = readlink(path, linkbuf, sizeof(linkbuf) - 1);
+    if (len < 0) {
+        if (errno == ENOENT)
+            return;
+        ERR("readlink");
+    }
+    linkbuf[len] = '\0';
+
+    size_t root_len = strlen(remote.root);
+    if (linkbuf[0] == '/' && realpath(linkbuf, link_real) && is_inside(remote.root, link_real)) {
+        writer_record(&remote.out, OP_SYMLINK, 1, 0, 0, rel_path(path), link_real + root_len);
+        return;
+    }
+    writer_record(&remote.out, OP_SYMLINK, 0, 0, 0, rel_path(path), linkbuf);
+}
+
+// sends everything under path that the receiver does not already have according to the manifest
+void remote_send_tree(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        if (errno == ENOENT)
+            return;
+        ERR("lstat");
+    }
+    const char *rel = rel_path(path);
+    struct ManifestEntry *m = manifest_find(rel);
+
+    if (S_ISREG(st.st_mode)) {
+        if (!m || !S_ISREG(m->mode) || m->size != (uint64_t)st.st_size || m->mtime != mtime_ns(&st))
+            remote_send_file(path);
+        else if ((m->mode & 07777) != (st.st_mode & 07777))
+            writer_record(&remote.out, OP_META, st.st_mode & 07777, mtime_ns(&st), 0, rel, NULL);
+        return;
+    }
+    if (S_ISLNK(st.st_mode)) {
+        remote_send_symlink(path);
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        if (rel[0] != '\0' && (!m || !S_ISDIR(m->mode)))
+            writer_record(&remote.out, OP_MKDIR, st.st_mode & 07777, 0, 0, rel, NULL);
+
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+            ERR("opendir");
+        struct dirent *e;
+        char child[PATH_MAX];
+        while ((e = readdir(dir)) != NULL) {
+            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..") || is_temp_name(e->d_name))
+                continue;
+            snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+            remote_send_tree(child);
+        }
+        closedir(dir);
+    }
+}
+
+// fetches the receiver manifest and sends what differs from the source,
+// -1 if the connection dropped and REMOTE_BUSY if the receiver already serves another sender
+int remote_sync() {
+    writer_record(&remote.out, OP_HELLO, 0, 0, 0, "", REMOTE_MAGIC);
+    writer_flush(&remote.out);
+    if (remote.out.broken)
+        return -1;
+
+    struct Reader r = {.fd = remote.out.fd, .listen_fd = -1};
+    struct Record rec;
+    int capacity = 0;
+    manifest_free();
+    while (1) {
+        if (reader_record(&r, &rec) == -1) {
+            manifest_free();
+            return -1;
+        }
+        if (rec.op == OP_END)
+            break;
+        if (rec.op == OP_BUSY) {
+            fprintf(stderr, "Receiver at %s is busy with another source!\n", remote.addr);
+            manifest_free();
+            return REMOTE_BUSY;
+        }
+        if (rec.op != OP_MANIFEST) {
+            fprintf(stderr, "Unexpected record %d in manifest from %s\n", rec.op, remote.addr);
+            manifest_free();
+            return -1;
+        }
+        if (remote.manifest_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            remote.manifest = realloc(remote.manifest, capacity * sizeof(struct ManifestEntry));
+            if (remote.manifest == NULL)
+                ERR("realloc");
+        }
+        struct ManifestEntry *m = &remote.manifest[remote.manifest_count++];
+        m->path = strdup(rec.path);
+        m->mode = rec.mode;
+        m->mtime = rec.mtime;
+        m->size = rec.size;
+    }
+    if (remote.manifest_count > 0)
+        qsort(remote.manifest, remote.manifest_count, sizeof(struct ManifestEntry), manifest_cmp);
+
+    // deletes go first so nothing sent afterwards lands under a path that is about to be removed,
+    // entries whose type changed are deleted too and then count as missing
+    char path[PATH_MAX];
+    struct stat st;
+    for (int i = 0; i < remote.manifest_count; i++) {
+        struct ManifestEntry *m = &remote.manifest[i];
+        snprintf(path, sizeof(path), "%s%s", remote.root, m->path);
+        if (lstat(path, &st) == -1 || (st.st_mode & S_IFMT) != (m->mode & S_IFMT)) {
+            writer_record(&remote.out, OP_DELETE, 0, 0, 0, m->path, NULL);
+            m->mode = 0;
+        }
+    }
+    remote_send_tree(remote.root);
+    manifest_free();
+    writer_flush(&remote.out);
+    return remote.out.broken ? -1 : 0;
+}
+
+int remote_connect() {
+    remote.out.fd = remote_socket(remote.addr, 0);
+    if (remote.out.fd == -1)
+        return -1;
+    remote.out.broken = 0;
+    remote.out.len = 0;
+    int ret = remote_sync();
+    if (ret != 0) {
+        close(remote.out.fd);
+        remote.out.fd = -1;
+    }
+    return ret;
+}
+
+int remote_open(const char *addr, const char *root) {
+    strncpy(remote.addr, addr, PATH_MAX - 1);
+    strncpy(remote.root, root, PATH_MAX - 1);
+    return remote_connect();
+}
+
+void remote_close() {
+    writer_flush(&remote.out);
+    close(remote.out.fd);
+    remote.out.fd = -1;
+}
+
+// events seen while disconnected are lost, so after reconnecting the manifest sync brings the receiver up to date,
+// -1 when stopped or when another source took the receiver over meanwhile
+int remote_reconnect() {
+    fprintf(stderr, "Connection to %s lost, reconnecting...\n", remote.addr);
+    close(remote.out.fd);
+    remote.out.fd = -1;
+    while (last_signal != SIGINT && last_signal != SIGTERM) {
+        sleep(RECONNECT_DELAY);
+        int ret = remote_connect();
+        if (ret == 0) {
+            fprintf(stderr, "Reconnected to %s.\n", remote.addr);
+            return 0;
+        }
+        if (ret == REMOTE_BUSY)
+            return -1;
+    }
+    return -1;
+}
+
+// forwards one inotify event, returns 1 when next was its IN_MOVED_TO half and got used as well
+int remote_event(int fd, struct WatchMap *map, struct inotify_event *event, struct inotify_event *next,
+                 const char *source_path) {
+    struct stat st;
+    if ((event->mask & IN_MOVED_FROM) && next && (next->mask & IN_MOVED_TO) && next->cookie == event->cookie) {
+        char new_path[PATH_MAX];
+        struct Watch *w = find_watch(map, next->wd);
+        snprintf(new_path, sizeof(new_path), "%s/%s", w->path, next->name);
+        writer_record(&remote.out, OP_RENAME, 0, 0, 0, rel_path(source_path), rel_path(new_path));
+        // a moved directory keeps its watch descriptors, only the paths we know them by change
+        if (lstat(new_path, &st) == 0 && S_ISDIR(st.st_mode))
+            rename_watches(map, source_path, new_path);
+        return 1;
+    }
+
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        remote_send_tree(source_path);
+        if (lstat(source_path, &st) == 0 && S_ISDIR(st.st_mode))
+            add_watch_recursive(fd, map, source_path);
+    }
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        writer_record(&remote.out, OP_DELETE, 0, 0, 0, rel_path(source_path), NULL);
+    if ((event->mask & IN_MODIFY) && lstat(source_path, &st) == 0 && S_ISREG(st.st_mode))
+        remote_send_file(source_path);
+    if ((event->mask & IN_ATTRIB) && event->len > 0 && lstat(source_path, &st) == 0 && !S_ISLNK(st.st_mode))
+        writer_record(&remote.out, OP_META, st.st_mode & 07777, mtime_ns(&st), 0, rel_path(source_path), NULL);
+    return 0;
+}
+
+//          RECEIVER
+
+// accepts only "/a/b" style paths below root without ".." and without symlinks among the parents,
+// so that a peer cannot make the receiver write outside root
+int valid_rel_path(const char *root, const char *rel) {
+    if (rel[0] != '/' || rel[1] == '\0')
+        return 0;
+    for (const char *p = rel; (p = strstr(p, "/..")) != NULL; p += 3) {
+        if (p[3] == '\0' || p[3] == '/')
+            return 0;
+    }
+
+    char path[PATH_MAX];
+    struct stat st;
+    size_t root_len = strlen(root);
+    for (const char *p = strchr(rel + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        if (p[-1] == '/')
+            return 0;
+        if (root_len + (p - rel) >= sizeof(path))
+            return 0;
+        snprintf(path, sizeof(path), "%s%.*s", root, (int)(p - rel), rel);
+        if (lstat(path, &st) == 0 && !S_ISDIR(st.st_mode))
+            return 0;
+    }
+    return 1;
+}
+
+// -1 after logging on failure, a path that is already gone counts as removed
+int remove_recursive(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        if (errno == ENOENT || errno == ENOTDIR)
+            return 0;
+        perror(path);
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlink(path) == -1 && errno != ENOENT) {
+            perror(path);
+            return -1;
+        }
+        return 0;
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        return -1;
+    }
+    struct dirent *e;
+    char child[PATH_MAX];
+    int ret = 0;
+    while (ret == 0 && (e = readdir(dir)) != NULL) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        ret = remove_recursive(child);
+    }
+    closedir(dir);
+    if (ret == 0 && rmdir(path) == -1) {
+        perror(path);
+        return -1;
+    }
+    return ret;
+}
+
+// clears path for an entry of the given type, pending group commits for it are dropped as well
+int replace_entry(const char *path, mode_t type) {
+    struct stat st;
+    group_commit_discard(path);
+    if (lstat(path, &st) == 0 && ((st.st_mode & S_IFMT) != type || S_ISLNK(st.st_mode)))
+        return remove_recursive(path);
+    return 0;
+}
+
+// -1 after logging when part of the tree cannot be read
+int send_manifest(struct Writer *w, const char *root, const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        return -1;
+    }
+    struct dirent *e;
+    struct stat st;
+    char child[PATH_MAX];
+    int ret = 0;
+    while (ret == 0 && (e = readdir(dir)) != NULL) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..") || is_temp_name(e->d_name))
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        if (lstat(child, &st) == -1) {
+            perror(child);
+            ret = -1;
+            break;
+        }
+        writer_record(w, OP_MANIFEST, st.st_mode, mtime_ns(&st), st.st_size, child + strlen(root), NULL);
+        if (S_ISDIR(st.st_mode))
+            ret = send_manifest(w, root, child);
+    }
+    closedir(dir);
+    return ret;
+}
+
+int receive_file(struct Reader *r, struct Record *rec, const char *path) {
+    char tmp[PATH_MAX];
+    if (replace_entry(path, S_IFREG) == -1)
+        return -1;
+    int fd = open_target(path, tmp);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    char buf[8192];
+    uint64_t left = rec->size;
+    while (left > 0) {
+        size_t n = left < sizeof(buf) ? left : sizeof(buf);
+        // sender went away mid-file, the manifest sync after reconnecting sends it again
+        int lost = reader_get(r, buf, n) == -1;
+        if (lost || write(fd, buf, n) != (ssize_t)n) {
+            if (!lost)
+                perror(path);
+            close(fd);
+            if (dur.mode != DUR_NONE)
+                unlink(tmp);
+            return -1;
+        }
+        left -= n;
+    }
+
+    struct timespec ts[2] = {{0, UTIME_OMIT}, {rec->mtime / 1000000000ULL, rec->mtime % 1000000000ULL}};
+    if (fchmod(fd, rec->mode & 07777) == -1 || futimens(fd, ts) == -1) {
+        perror(path);
+        close(fd);
+        if (dur.mode != DUR_NONE)
+            unlink(tmp);
+        return -1;
+    }
+    commit_target(fd, tmp, path, rec->size);
+    return 0;
+}
+
+// applies one record, -1 after logging when it cannot be applied
+int apply_record(struct Reader *r, struct Record *rec, const char *root) {
+    char path[PATH_MAX], arg[PATH_MAX];
+    struct stat st;
+
+    if (!valid_rel_path(root, rec->path) || (rec->op == OP_RENAME && !valid_rel_path(root, rec->arg))) {
+        fprintf(stderr, "Receiver: bad path %s %s\n", rec->path, rec->arg);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s%s", root, rec->path);
+
+    switch (rec->op) {
+        case OP_MKDIR:
+            if (replace_entry(path, S_IFDIR) == -1)
+                return -1;
+            if (mkdir(path, rec->mode & 07777) == -1 && errno != EEXIST) {
+                perror(path);
+                return -1;
+            }
+            durable_entry(path);
+            return 0;
+        case OP_FILE:
+            return receive_file(r, rec, path);
+        case OP_SYMLINK:
+            if (replace_entry(path, S_IFLNK) == -1)
+                return -1;
+            if (rec->mode == 1)
+                snprintf(arg, sizeof(arg), "%s%s", root, rec->arg);
+            else
+                snprintf(arg, sizeof(arg), "%s", rec->arg);
+            if (symlink(arg, path) == -1) {
+                perror(path);
+                return -1;
+            }
+            durable_entry(path);
+            return 0;
+        case OP_DELETE:
+            group_commit_discard(path);
+            if (remove_recursive(path) == -1)
+                return -1;
+            durable_entry(path);
+            return 0;
+        case OP_RENAME:
+            snprintf(arg, sizeof(arg), "%s%s", root, rec->arg);
+            group_commit_flush();
+            if (lstat(path, &st) == -1)
+                return 0;
+            if (replace_entry(arg, st.st_mode & S_IFMT) == -1)
+                return -1;
+            if (S_ISDIR(st.st_mode) && remove_recursive(arg) == -1)
+                return -1;
+            if (rename(path, arg) == -1) {
+                perror(arg);
+                return -1;
+            }
+            durable_entry(arg);
+            return 0;
+        case OP_META:
+            group_commit_flush();
+            if (lstat(path, &st) == -1 || S_ISLNK(st.st_mode))
+                return 0;
+            struct timespec ts[2] = {{0, UTIME_OMIT}, {rec->mtime / 1000000000ULL, rec->mtime % 1000000000ULL}};
+            if (chmod(path, rec->mode & 07777) == -1 || utimensat(AT_FDCWD, path, ts, 0) == -1) {
+                perror(path);
+                return -1;
+            }
+            return 0;
+        default:
+            fprintf(stderr, "Receiver: unknown operation %d\n", rec->op);
+            return -1;
+    }
+}
+
+// applies the records of one connection to root until the sender disconnects or sends something unusable
+void receive_stream(int conn, int listen_fd, const char *root) {
+    static struct Writer w;
+    struct Reader r = {.fd = conn, .listen_fd = listen_fd};
+    struct Record rec;
+
+    // a connection closed without a word is a liveness probe from another serve, not an error
+    if (reader_record(&r, &rec) == -1)
+        return;
+    if (rec.op != OP_HELLO || strcmp(rec.arg, REMOTE_MAGIC) != 0) {
+        fprintf(stderr, "Receiver: bad handshake\n");
+        return;
+    }
+    w.fd = conn;
+    w.broken = 0;
+    w.len = 0;
+    group_commit_flush();
+    if (send_manifest(&w, root, root) == -1) {
+        fprintf(stderr, "Receiver: dropping connection\n");
+        return;
+    }
+    writer_record(&w, OP_END, 0, 0, 0, "", NULL);
+    writer_flush(&w);
+
+    while (reader_record(&r, &rec) == 0) {
+        if (apply_record(&r, &rec, root) == -1) {
+            fprintf(stderr, "Receiver: dropping connection\n");
+            return;
+        }
+    }
+}
+
+void receiver_work(int listen_fd, const char *addr, const char *root) {
+    sethandler(sig_handler, SIGINT);
+    sethandler(sig_handler, SIGTERM);
+    durability_begin(root);
+
+    while (last_signal != SIGINT && last_signal != SIGTERM) {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR)
+                continue;
+            ERR("accept");
+        }
+        receive_stream(conn, listen_fd, root);
+        group_commit_flush();
+        close(conn);
+    }
+    durability_end();
+    close(listen_fd);
+    if (strncmp(addr, "unix:", 5) == 0)
+        unlink(addr + 5);
+    exit(0);
+}
+
 void child_work(char* real_source, char* real_target){
     sethandler(sig_handler, SIGINT);
     sethandler(sig_handler, SIGTERM);
@@ -346,11 +1421,23 @@ void child_work(char* real_source, char* real_target){
     sigdelset(&sig_mask, SIGTERM);
     sigdelset(&sig_mask, SIGCHLD);
     sigprocmask(SIG_BLOCK, &sig_mask, NULL);
+
+    // the initial sync of a remote target runs here so a slow or busy receiver never blocks the command loop
+    if (is_remote(real_target)) {
+        if (remote_open(real_target, real_source) != 0) {
+            fprintf(stderr, "Backup to %s failed!\n", real_target);
+            exit(EXIT_FAILURE);
+        }
+        printf("Backup to %s complete.\n", real_target);
+        fflush(stdout);
+    }
+
     int fd = inotify_init();
     if (fd < 0) {
         ERR("inotify_init");}
     struct WatchMap map = {0};
     add_watch_recursive(fd, &map, real_source);
+    durability_begin(real_target);
 
 
     char buf[65536];
@@ -361,6 +1448,28 @@ void child_work(char* real_source, char* real_target){
             to_exit = 1;
             break;
         }
+        if (dur.mode == DUR_GROUP && group_commit_pending() > 0) {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            int ready = poll(&pfd, 1, group_commit_timeout());
+            if (ready < 0) {
+                if (errno == EINTR)
+                    continue;
+                ERR("poll");
+            }
+            if (ready == 0) {
+                group_commit_flush();
+                continue;
+            }
+        }
+        // whatever the last batch of events produced goes out before waiting for more
+        if (remote.out.fd != -1) {
+            writer_flush(&remote.out);
+            if (remote.out.broken) {
+                if (remote_reconnect() == -1)
+                    break;
+                continue;
+            }
+        }
         ssize_t len = read(fd, buf, sizeof(buf));
         if (len < 0){ 
             if (errno == EINTR){
@@ -371,6 +1480,10 @@ void child_work(char* real_source, char* real_target){
         while (i < len) {
             struct inotify_event *event = (struct inotify_event *)&buf[i];
             struct Watch *w = find_watch(&map, event->wd);
+            if (event->len > 0 && is_temp_name(event->name)) {
+                i += sizeof(struct inotify_event) + event->len;
+                continue;
+            }
             
             
             char source_path[PATH_MAX];
@@ -384,6 +1497,22 @@ void child_work(char* real_source, char* real_target){
                 snprintf(target_path, sizeof(target_path), "%s%s", real_target, source_path + strlen(real_source));
             }
 
+            if (remote.out.fd != -1) {
+                ssize_t step = sizeof(struct inotify_event) + event->len;
+                struct inotify_event *next = NULL;
+                if (i + step < len)
+                    next = (struct inotify_event *)&buf[i + step];
+                if (remote_event(fd, &map, event, next, source_path))
+                    step += sizeof(struct inotify_event) + next->len;
+                // only the source root going away ends the backup, removed subdirectories are plain deletes
+                if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) && event->wd == map.watch_map[0].wd) {
+                    to_exit = 1;
+                    break;
+                }
+                i += step;
+                continue;
+            }
+
             if ((event->mask & IN_CREATE) || (event->mask & IN_MOVED_TO)) {
 
                 if (event->len > 0) {
@@ -393,6 +1522,8 @@ void child_work(char* real_source, char* real_target){
                     if (S_ISDIR(st1.st_mode)) {
                         if (mkdir(target_path, st1.st_mode & 0777) == -1){
                             perror("mkdir(IN_CREATE)");}
+                        else
+                            durable_entry(target_path);
                         add_watch_recursive(fd, &map, source_path);     
                         } 
                         
@@ -403,11 +1534,14 @@ void child_work(char* real_source, char* real_target){
                 }
             }
 
-            if ((event->mask & IN_DELETE) || (event->mask & IN_MOVED_FROM)){
+            struct stat st_del;
+            if (((event->mask & IN_DELETE) || (event->mask & IN_MOVED_FROM)) &&
+                !(group_commit_discard(target_path) > 0 && lstat(target_path, &st_del) == -1 && errno == ENOENT)){
                 if(unlink(target_path) == -1)
                     if(remove(target_path) == -1)
                             if(rmdir(target_path) == -1)
-                                    ERR("rmdir");}
+                                    ERR("rmdir");
+                durable_entry(target_path);}
 
             if ((event->mask & IN_MODIFY)){ 
                 struct stat st2;
@@ -431,6 +1565,9 @@ void child_work(char* real_source, char* real_target){
         }
     }
     close(fd);
+    durability_end();
+    if (remote.out.fd != -1)
+        remote_close();
     exit(0);
 }
 
@@ -469,6 +1606,24 @@ int parse_args(char *line, char *argv[])
 }
 
 
+// forgets children that already exited, like a remote backup whose receiver could not be reached,
+// so that list does not show them and their target can be added again
+void reap_children(child_info* children, int* child_count, Backup* backups, int backup_count){
+    int kept = 0;
+    for(int i = 0; i < *child_count; i++){
+        pid_t r = waitpid(children[i].pid, NULL, WNOHANG);
+        if(r == children[i].pid || (r == -1 && errno == ECHILD)){
+            for(int j = 0; j < backup_count; j++){
+                if(backups[j].pid == children[i].pid)
+                    backups[j].active = 0;
+            }
+            continue;
+        }
+        children[kept++] = children[i];
+    }
+    *child_count = kept;
+}
+
 void exit_fun(child_info* children, int child_count){
     for (int i = 0; i < child_count; i++) {
                 kill(children[i].pid, SIGTERM);
@@ -481,6 +1636,101 @@ void exit_fun(child_info* children, int child_count){
             exit(0);
 }
 
+// strips "-d <mode>" after the command name, 1 if it was there, -1 if the mode is wrong
+// or the command does not write files
+int take_durability_opt(int* argc, char* argv[], durability_mode* mode){
+    *mode = DUR_NONE;
+    if(*argc < 2 || strcmp(argv[1], "-d") != 0)
+        return 0;
+    if(strcmp(argv[0], "add") != 0 && strcmp(argv[0], "restore") != 0 && strcmp(argv[0], "serve") != 0){
+        fprintf(stderr, "-d is only accepted by add, restore and serve!\n");
+        return -1;
+    }
+    if(*argc < 3 || parse_durability(argv[2], mode) == -1){
+        fprintf(stderr, "Durability must be one of: none, atomic, group\n");
+        return -1;
+    }
+    for(int i = 3; i < *argc; i++)
+        argv[i - 2] = argv[i];
+    *argc -= 2;
+    return 1;
+}
+
+// reads every file under path once so that no mode pays for a cold source
+void warm_tree(const char* path){
+    struct stat st;
+    if(lstat(path, &st) == -1)
+        ERR("lstat");
+    if(S_ISREG(st.st_mode)){
+        int fd = open(path, O_RDONLY);
+        if(fd == -1)
+            ERR("open");
+        char buf[8192];
+        while(read(fd, buf, sizeof(buf)) > 0){}
+        close(fd);
+        return;
+    }
+    if(!S_ISDIR(st.st_mode))
+        return;
+    DIR *dir = opendir(path);
+    if(dir == NULL)
+        ERR("opendir");
+    struct dirent *e;
+    char child[PATH_MAX];
+    while((e = readdir(dir)) != NULL){
+        if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 || is_temp_name(e->d_name))
+            continue;
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        warm_tree(child);
+    }
+    closedir(dir);
+}
+
+// copies source once per durability mode into <target>/<mode> and prints the throughput of each
+void bench_durability(const char* real_source, const char* real_target){
+    durability_mode modes[] = {DUR_NONE, DUR_ATOMIC, DUR_GROUP};
+    char dir[PATH_MAX];
+
+    int target_fd = open(real_target, O_RDONLY | O_DIRECTORY);
+    if(target_fd == -1)
+        ERR("open");
+    warm_tree(real_source);
+
+    printf("%-8s %10s %12s %10s %12s %10s\n", "mode", "files", "MB", "seconds", "files/s", "MB/s");
+    for(int i = 0; i < 3; i++){
+        snprintf(dir, sizeof(dir), "%s/%s", real_target, durability_name(modes[i]));
+        if(mkdir(dir, 0777) == -1 && errno != EEXIST)
+            ERR("mkdir");
+        if(!isDirectoryEmpty(dir)){
+            fprintf(stderr, "%s must be empty!\n", dir);
+            close(target_fd);
+            return;
+        }
+
+        // dirty pages of the previous run must not be written out on the clock of this one
+        if(syncfs(target_fd) == -1)
+            ERR("syncfs");
+
+        dur.mode = modes[i];
+        dur.files = 0;
+        dur.bytes = 0;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        durability_begin(dir);
+        copy_recursive(real_source, dir, real_source, dir);
+        durability_end();
+        double secs = elapsed_ms(&start) / 1000.0;
+        if(secs <= 0)
+            secs = 0.001;
+
+        double mb = dur.bytes / (1024.0 * 1024.0);
+        printf("%-8s %10ld %12.2f %10.3f %12.1f %10.2f\n", durability_name(modes[i]), dur.files, mb, secs,
+               dur.files / secs, mb / secs);
+    }
+    close(target_fd);
+    dur.mode = DUR_NONE;
+}
+
 int main(){
     sethandler(sig_handler, SIGINT);
     sethandler(sig_handler, SIGTERM);
@@ -501,10 +1751,12 @@ int main(){
     Backup backups[64];
     static int backup_count = 0;
 
-    printf("Available commands:\n\t->add <souce path> <target path> - start monitoring and backing up source directory\n\t"
+    printf("Available commands:\n\t->add [-d none|atomic|group] <souce path> <target path> - start monitoring and backing up source directory, target can be a serve address\n\t"
         "->end <source path> <target path> - stop monetring source directory\n\t"
         "->list - list currently monitoring directories\n\t"
-        "->restore <source path> <target path> - restores files in souce dir form the last backup\n\t"
+        "->restore [-d none|atomic|group] <source path> <target path> - restores files in souce dir form the last backup\n\t"
+        "->serve [-d none|atomic|group] <address> <target path> - receive backups sent to unix:<path> or tcp:<host>:<port> (loopback if host is empty)\n\t"
+        "->bench <source path> <target path> - compare copy throughput of durability modes\n\t"
         "->exit - terminate all monitorings\n");
     while(1){
         if (last_signal == SIGINT || last_signal == SIGTERM) {
@@ -517,6 +1769,10 @@ int main(){
             break;}
         char* argv[64];
         int argc = parse_args(cmd, argv);
+        durability_mode mode;
+        if(take_durability_opt(&argc, argv, &mode) == -1)
+            continue;
+        reap_children(children, &child_count, backups, backup_count);
         //          EXIT
         if (strncmp(cmd, "exit", 4) == 0) {
             exit_fun(children, child_count);
@@ -526,11 +1782,17 @@ int main(){
             char real_target_check[PATH_MAX];
             int counter_of_dup_targets = 0;
             for(int i = 2; i < argc; i++){
-                if (mkdir(argv[i], 0777) == -1 && errno != EEXIST) {
-                    ERR("mkdir");
+                if (is_remote(argv[i])) {
+                    strncpy(real_target_check, argv[i], PATH_MAX - 1);
+                    real_target_check[PATH_MAX - 1] = '\0';
                 }
-                if(!realpath(argv[i], real_target_check)){
-                    ERR("realpath");
+                else {
+                    if (mkdir(argv[i], 0777) == -1 && errno != EEXIST) {
+                        ERR("mkdir");
+                    }
+                    if(!realpath(argv[i], real_target_check)){
+                        ERR("realpath");
+                    }
                 }
                 for(int k = 0; k < child_count;k++){
                     if(strcmp(real_target_check, children[k].target) == 0){
@@ -566,25 +1828,38 @@ int main(){
             for(int i = 2; i < argc;i++){
                 char* target = argv[i];
 
-                if (!realpath(target, real_target)) {
-                    ERR("realpath");
+                if (is_remote(target)) {
+                    // durability of a remote target is chosen by its receiver, the sync itself runs in the child
+                    strncpy(real_target, target, PATH_MAX - 1);
+                    real_target[PATH_MAX - 1] = '\0';
+                    dur.mode = DUR_NONE;
+                    printf("Starting backup to %s...\n", real_target);
+                    fflush(stdout);
                 }
+                else {
+                    if (!realpath(target, real_target)) {
+                        ERR("realpath");
+                    }
 
-                if(strncmp(real_source, real_target, strlen(real_source)) == 0 && (real_target[strlen(real_source)] == '/' || real_target[strlen(real_source)] == '\0')){
-                    fprintf(stderr, "target can NOT be in source!!");
-                    continue;
-                }
-                
-                if(!isDirectoryEmpty(real_target)){
-                    fprintf(stderr, "target directory must be empty!\n");
-                    continue;
-                }
+                    if(is_inside(real_source, real_target)){
+                        fprintf(stderr, "target can NOT be in source!!");
+                        continue;
+                    }
+                    
+                    if(!isDirectoryEmpty(real_target)){
+                        fprintf(stderr, "target directory must be empty!\n");
+                        continue;
+                    }
 
-                //              INIT COPY
+                    //              INIT COPY
 
-                printf("Starting backup...\n");
-                copy_recursive(real_source, real_target, real_source, real_target);
-                printf("Backup complete.\n");
+                    printf("Starting backup (durability: %s)...\n", durability_name(mode));
+                    dur.mode = mode;
+                    durability_begin(real_target);
+                    copy_recursive(real_source, real_target, real_source, real_target);
+                    durability_end();
+                    printf("Backup complete.\n");
+                }
                 
 
 
@@ -644,7 +1919,11 @@ int main(){
                 continue;
             }
             for (int i = 2; i < argc; i++) {
-                if (!realpath(argv[i], real_target)) {
+                if (is_remote(argv[i])) {
+                    strncpy(real_target, argv[i], PATH_MAX - 1);
+                    real_target[PATH_MAX - 1] = '\0';
+                }
+                else if (!realpath(argv[i], real_target)) {
                     continue;
                 }
                 int exist = 0;
@@ -668,6 +1947,10 @@ int main(){
         else if(argc == 3 && strcmp(argv[0], "restore") == 0){
             char real_target[PATH_MAX];
             char real_src[PATH_MAX];
+            if (is_remote(argv[1]) || is_remote(argv[2])) {
+                fprintf(stderr, "Restore works only from a local backup, restore from the receiver's directory instead!\n");
+                continue;
+            }
             if (!realpath(argv[1], real_src)) {
                 ERR("realpath");
             }   
@@ -682,16 +1965,84 @@ int main(){
 
             printf("Restoring backup...\n");
 
+            dur.mode = mode;
+            durability_begin(real_src);
             restore_recursive(real_src, real_target, real_src, real_target);
+            durability_end();
 
             printf("Restore complete.\n");
         }
+        //          SERVE
+        else if(argc == 3 && strcmp(argv[0], "serve") == 0){
+            char real_dir[PATH_MAX];
+            if (!is_remote(argv[1])) {
+                fprintf(stderr, "Address must be unix:<path> or tcp:<host>:<port>!\n");
+                continue;
+            }
+            if (mkdir(argv[2], 0777) == -1 && errno != EEXIST)
+                ERR("mkdir");
+            if (!realpath(argv[2], real_dir))
+                ERR("realpath");
+            // a served directory is a backup target like any other, two writers would overwrite each other
+            int in_use = 0;
+            for (int k = 0; k < child_count; k++) {
+                if (strcmp(real_dir, children[k].target) == 0)
+                    in_use = 1;
+            }
+            if (in_use) {
+                fprintf(stderr, "CANT REPEAT TARGET!\n");
+                continue;
+            }
+            int listen_fd = remote_socket(argv[1], 1);
+            if (listen_fd == -1) {
+                fprintf(stderr, "Cannot listen on %s!\n", argv[1]);
+                continue;
+            }
+
+            pid_t pid = fork();
+            if(pid == 0){
+                dur.mode = mode;
+                receiver_work(listen_fd, argv[1], real_dir);
+            }
+            else if(pid > 0){
+                close(listen_fd);
+                children[child_count].pid = pid;
+                snprintf(children[child_count].target, sizeof(children[child_count].target), "%s", real_dir);
+                child_count++;
+                printf("Receiving on %s into %s (durability: %s)\n", argv[1], real_dir, durability_name(mode));
+            }
+            else{
+                ERR("fork");
+            }
+        }
+        //          BENCH
+        else if(argc == 3 && strcmp(argv[0], "bench") == 0){
+            char real_source[PATH_MAX], real_target[PATH_MAX];
+            if (!realpath(argv[1], real_source)) {
+                fprintf(stderr, "Source does not exist!\n");
+                continue;
+            }
+            int created = mkdir(argv[2], 0777) == 0;
+            if (!created && errno != EEXIST)
+                ERR("mkdir");
+            if (!realpath(argv[2], real_target))
+                ERR("realpath");
+            if (is_inside(real_source, real_target)) {
+                fprintf(stderr, "target can NOT be in source!!\n");
+                if (created)
+                    rmdir(real_target);
+                continue;
+            }
+            bench_durability(real_source, real_target);
+        }
         else{
             printf("Wrong command, please select one of the following:");
-            printf("\n\t->add <souce path> <target path> - start monitoring and backing up source directory\n\t"
+            printf("\n\t->add [-d none|atomic|group] <souce path> <target path> - start monitoring and backing up source directory, target can be a serve address\n\t"
         "->end <source path> <target path> - stop monetring source directory\n\t"
         "->list - list currently monitoring directories\n\t"
-        "->restore <source path> <target path> - restores files in souce dir form the last backup\n\t"
+        "->restore [-d none|atomic|group] <source path> <target path> - restores files in souce dir form the last backup\n\t"
+        "->serve [-d none|atomic|group] <address> <target path> - receive backups sent to unix:<path> or tcp:<host>:<port> (loopback if host is empty)\n\t"
+        "->bench <source path> <target path> - compare copy throughput of durability modes\n\t"
         "->exit - terminate all monitorings\n");
         }
     }    